@@ -0,0 +1,308 @@
+// Startup latency benchmark for the sandbox CLI (make bench).
+//
+// Runs create (-c), enter (-e) and delete (-d) of a fresh sandbox repeatedly, in
+// isolated and network mode, and collects the wall time of each operation plus the
+// per-phase timings the sandbox binary appends to $SANDBOX_TIMINGS_FILE. Prints
+// percentiles and a histogram per phase and writes the same as JSON, so that runs
+// can be compared by a script.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+
+#define DEFAULT_ITERATIONS 20
+#define DEFAULT_WARMUP 1
+#define MAX_SERIES 256
+
+// Upper bucket edges in ms; the last bucket takes everything above
+static const double histogram_edges[] = {0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+#define HISTOGRAM_BUCKETS (int)(sizeof(histogram_edges) / sizeof(histogram_edges[0]) + 1)
+
+// Samples of one phase of one operation in one mode
+struct Series {
+    const char *mode;
+    const char *op;
+    char phase[64];
+    double *ms;
+    int count;
+    int capacity;
+};
+
+static struct Series series[MAX_SERIES];
+static int series_count = 0;
+static int failures = 0;
+
+static const char *sandbox_binary = "bin/sandbox";
+static char work_dir[PATH_MAX];
+static char timings_path[PATH_MAX + 16];
+
+static double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void add_sample(const char *mode, const char *op, const char *phase, double ms) {
+    struct Series *s = NULL;
+    for (int i = 0; i < series_count && !s; i++) {
+        if (series[i].mode == mode && series[i].op == op && strcmp(series[i].phase, phase) == 0) s = &series[i];
+    }
+    if (!s) {
+        if (series_count == MAX_SERIES) return;
+        s = &series[series_count++];
+        s->mode = mode;
+        s->op = op;
+        snprintf(s->phase, sizeof(s->phase), "%s", phase);
+    }
+    if (s->count == s->capacity) {
+        int capacity = s->capacity ? s->capacity * 2 : 32;
+        double *ms = realloc(s->ms, sizeof(double) * capacity);
+        if (!ms) return;
+        s->ms = ms;
+        s->capacity = capacity;
+    }
+    s->ms[s->count++] = ms;
+}
+
+// Run the sandbox binary with the given arguments and its output discarded.
+// Returns its exit status, or -1 when it could not be run.
+static int run_sandbox(char *const argv[]) {
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, 0);  // The shell of -c and -e exits at EOF
+            dup2(null_fd, 1);
+            dup2(null_fd, 2);
+        }
+        // sandboxes.txt, which -c writes and -e reads, lives in the current directory
+        if (chdir(work_dir) == -1) _exit(126);
+        execv(sandbox_binary, argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Time one operation and record it along with the phases it reported
+static int bench_op(const char *mode, const char *op, char *const argv[], int record) {
+    struct timespec start;
+    truncate(timings_path, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = run_sandbox(argv);
+    double wall = elapsed_ms(&start);
+    if (rc != 0) {
+        fprintf(stderr, "Warning: %s %s exited with %d\n", mode, op, rc);
+        failures++;
+        return -1;
+    }
+    if (!record) return 0;
+
+    add_sample(mode, op, "wall", wall);
+    FILE *f = fopen(timings_path, "r");
+    char line[256], name[256], phase[64];
+    double ms;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%255[^\t]\t%63[^\t]\t%lf", name, phase, &ms) == 3) add_sample(mode, op, phase, ms);
+    }
+    if (f) fclose(f);
+    return 0;
+}
+
+static void bench_mode(const char *mode, int iterations, int warmup) {
+    char name[64];
+    char *network = strcmp(mode, "network") == 0 ? "-n" : NULL;
+
+    for (int i = 0; i < warmup + iterations; i++) {
+        int record = i >= warmup;  // The first rounds fill the rootfs cache and host tree
+        snprintf(name, sizeof(name), "bench-%s-%d-%d", mode, (int)getpid(), i);
+        char *create[] = {(char *)sandbox_binary, "-c", "-s", name, network, NULL};
+        char *enter[] = {(char *)sandbox_binary, "-e", "-s", name, NULL};
+        char *delete[] = {(char *)sandbox_binary, "-d", "-s", name, NULL};
+        if (bench_op(mode, "create", create, record) == 0) bench_op(mode, "enter", enter, record);
+        bench_op(mode, "delete", delete, record);
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const struct Series *s, int p) {
+    int rank = (s->count * p + 99) / 100;
+    return s->ms[rank > 0 ? rank - 1 : 0];
+}
+
+static void histogram(const struct Series *s, int *buckets) {
+    memset(buckets, 0, sizeof(int) * HISTOGRAM_BUCKETS);
+    for (int i = 0; i < s->count; i++) {
+        int b = 0;
+        while (b < HISTOGRAM_BUCKETS - 1 && s->ms[i] > histogram_edges[b]) b++;
+        buckets[b]++;
+    }
+}
+
+static double mean(const struct Series *s) {
+    double sum = 0;
+    for (int i = 0; i < s->count; i++) sum += s->ms[i];
+    return sum / s->count;
+}
+
+static void print_report(void) {
+    int buckets[HISTOGRAM_BUCKETS];
+    const char *mode = NULL, *op = NULL;
+
+    for (int i = 0; i < series_count; i++) {
+        struct Series *s = &series[i];
+        if (s->mode != mode || s->op != op) {
+            mode = s->mode;
+            op = s->op;
+            printf("\n%s %s\n", mode, op);
+            printf("  %-24s %5s %9s %9s %9s %9s %9s\n", "phase (ms)", "n", "mean", "p50", "p90", "p99", "max");
+        }
+        printf("  %-24s %5d %9.2f %9.2f %9.2f %9.2f %9.2f\n", s->phase, s->count, mean(s), percentile(s, 50),
+               percentile(s, 90), percentile(s, 99), s->ms[s->count - 1]);
+
+        histogram(s, buckets);
+        printf("  %-24s", "");
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (!buckets[b]) continue;
+            if (b < HISTOGRAM_BUCKETS - 1) printf(" <=%g:%d", histogram_edges[b], buckets[b]);
+            else printf(" >%g:%d", histogram_edges[b - 1], buckets[b]);
+        }
+        printf("\n");
+    }
+}
+
+static int write_results(const char *path, int iterations) {
+    int buckets[HISTOGRAM_BUCKETS];
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"iterations\": %d,\n  \"failures\": %d,\n  \"results\": [", iterations, failures);
+    for (int i = 0; i < series_count; i++) {
+        struct Series *s = &series[i];
+        fprintf(f, "%s\n    {\"mode\": \"%s\", \"op\": \"%s\", \"phase\": \"%s\", \"n\": %d, ", i ? "," : "",
+                s->mode, s->op, s->phase, s->count);
+        fprintf(f, "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, ",
+                mean(s), percentile(s, 50), percentile(s, 90), percentile(s, 99), s->ms[s->count - 1]);
+        histogram(s, buckets);
+        fprintf(f, "\"histogram\": [");
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (b < HISTOGRAM_BUCKETS - 1) fprintf(f, "%s{\"le_ms\": %g, \"count\": %d}", b ? ", " : "", histogram_edges[b], buckets[b]);
+            else fprintf(f, ", {\"le_ms\": null, \"count\": %d}", buckets[b]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+// Remove the scratch directory. Network sandboxes leave the shared host bind tree
+// mounted in the state dir for the next one, so it is detached first.
+static void remove_work_dir(const char *state_dir) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/.host_tree", state_dir);
+    while (umount2(path, MNT_DETACH) == 0) {
+    }
+    nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = DEFAULT_ITERATIONS;
+    int warmup = DEFAULT_WARMUP;
+    const char *output = "bench-results.json";
+    const char *modes = "isolated,network";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:s:o:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 's':
+                sandbox_binary = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'm':
+                modes = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-w warmup_rounds] [-s sandbox_binary] [-o results.json] [-m isolated,network]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iterations < 1 || warmup < 0) {
+        fprintf(stderr, "Error: -n must be >= 1 and -w >= 0\n");
+        return 1;
+    }
+    if (access(sandbox_binary, X_OK) == -1) {
+        fprintf(stderr, "Error: %s: %s\n", sandbox_binary, strerror(errno));
+        return 1;
+    }
+
+    // Paths given to the children must not depend on their working directory
+    static char binary[PATH_MAX];
+    if (!realpath(sandbox_binary, binary)) {
+        perror(sandbox_binary);
+        return 1;
+    }
+    sandbox_binary = binary;
+
+    // A scratch directory for sandboxes.txt, the timings file and the sandboxes' state
+    snprintf(work_dir, sizeof(work_dir), "/tmp/sandbox-bench.XXXXXX");
+    if (!mkdtemp(work_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char state_dir[PATH_MAX + 8];
+    snprintf(timings_path, sizeof(timings_path), "%s/timings", work_dir);
+    snprintf(state_dir, sizeof(state_dir), "%s/state", work_dir);
+    setenv("SANDBOX_TIMINGS_FILE", timings_path, 1);
+    setenv("SANDBOX_STATE_DIR", state_dir, 1);
+
+    if (strstr(modes, "isolated")) bench_mode("isolated", iterations, warmup);
+    if (strstr(modes, "network")) {
+        if (getuid() == 0) bench_mode("network", iterations, warmup);
+        else fprintf(stderr, "Skipping network mode: it requires root\n");
+    }
+
+    for (int i = 0; i < series_count; i++) {
+        qsort(series[i].ms, series[i].count, sizeof(double), compare_double);
+    }
+    print_report();
+    int rc = write_results(output, iterations) == 0 ? 0 : 1;
+    if (rc == 0) printf("\nResults written to %s\n", output);
+
+    remove_work_dir(state_dir);
+    return rc || failures ? 1 : 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <gtk/gtk.h>
 #include <vte/vte.h>
 #include <stdio.h>
@@ -10,6 +11,7 @@
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <ftw.h>
 
 // Global paths - will be set at runtime based on executable location
 static char g_config_file[PATH_MAX];
@@ -30,8 +32,23 @@ typedef struct {
     char name[256];
     int memory;      // MB
     int cpu_cores;   // Number of CPU cores (was: cpu time in seconds)
-    int network;
+    int network;     // 0 isolated, 1 host network, 2 private network (sandbox -N)
     time_t date;
+    int egress_kbit;   // Private network rate limits, 0 = unlimited
+    int ingress_kbit;
+    int cpu_milli;     // CPU quota in thousandths of a core (sandbox -p), 0 = unlimited
+    int cpu_weight;    // cpu.weight (sandbox -w), 0 = default
+    int cpu_burst_milli;
+    int cpu_exclusive; // Whole idle cores reserved (sandbox -x)
+    int memory_high;   // MB, sandbox -m high=, 0 = none
+    int memory_low;    // MB, sandbox -m low=
+    int memory_swap;   // MB, sandbox -m swap=, -1 = kernel default
+    int io_rbps;       // MB/s, sandbox -i rbps=, 0 = unlimited
+    int io_wbps;       // MB/s, sandbox -i wbps=
+    int io_riops;      // sandbox -i riops=
+    int io_wiops;      // sandbox -i wiops=
+    int io_weight;     // sandbox -i weight=, 0 = default
+    int pids_max;      // sandbox -P, 0 = unlimited
 } Sandbox;
 
 GtkWidget *entry_name;
@@ -42,6 +59,9 @@ GtkWidget *scale_cpu;
 GtkWidget *spin_cpu;
 GtkWidget *label_cpu_info;
 GtkWidget *check_network;
+GtkWidget *spin_io_bps;
+GtkWidget *spin_io_iops;
+GtkWidget *spin_pids;
 GtkWidget *listbox;
 GtkWidget *log_view;
 GQueue *log_buffer = NULL;
@@ -56,6 +76,7 @@ GtkWidget *detail_name_label;
 GtkWidget *detail_memory_label;
 GtkWidget *detail_cpu_label;
 GtkWidget *detail_network_label;
+GtkWidget *detail_limits_label;
 GtkWidget *detail_created_label;
 GtkWidget *detail_panel;
 GtkWidget *status_bar;
@@ -195,20 +216,32 @@ void load_sandboxes() {
     char line[512];
     while (fgets(line, sizeof(line), f)) {
         Sandbox *s = malloc(sizeof(Sandbox));
-        sscanf(line, "%s %d %d %d %ld", s->name, &s->memory, &s->cpu_cores, &s->network, &s->date);
+        // Fields after the date are optional, see sandbox_record_write() in main.c
+        s->egress_kbit = s->ingress_kbit = 0;
+        s->cpu_milli = -1;
+        s->cpu_weight = s->cpu_burst_milli = s->cpu_exclusive = 0;
+        s->memory_high = s->memory_low = 0;
+        s->memory_swap = -1;
+        s->io_rbps = s->io_wbps = s->io_riops = s->io_wiops = s->io_weight = s->pids_max = 0;
+        sscanf(line, "%s %d %d %d %ld %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", s->name, &s->memory,
+               &s->cpu_cores, &s->network, &s->date, &s->egress_kbit, &s->ingress_kbit, &s->cpu_milli,
+               &s->cpu_weight, &s->cpu_burst_milli, &s->cpu_exclusive, &s->memory_high, &s->memory_low,
+               &s->memory_swap, &s->io_rbps, &s->io_wbps, &s->io_riops, &s->io_wiops, &s->io_weight,
+               &s->pids_max);
+        if (s->cpu_milli < 0) s->cpu_milli = s->cpu_cores * 1000;
         sandboxes = g_list_append(sandboxes, s);
     }
     fclose(f);
 }
 
-void save_sandboxes() {
-    FILE *f = fopen(CONFIG_FILE, "w");
-    if (!f) return;
+// The CLI keeps the records (see sandbox_record_replace() in main.c); the GUI only reads them
+static void reload_sandboxes(void) {
     for (GList *l = sandboxes; l; l = l->next) {
-        Sandbox *s = l->data;
-        fprintf(f, "%s %d %d %d %ld\n", s->name, s->memory, s->cpu_cores, s->network, s->date);
+        free(l->data);
     }
-    fclose(f);
+    g_list_free(sandboxes);
+    sandboxes = NULL;
+    load_sandboxes();
 }
 
 static gboolean ensure_root(GtkWindow *parent) {
@@ -223,12 +256,14 @@ static gboolean ensure_root(GtkWindow *parent) {
     return FALSE;
 }
 
+// Runs the CLI next to sandboxes.txt, which it updates in its working directory
 static gboolean run_command(char *const argv[], GtkWindow *parent) {
     GError *err = NULL;
     gchar *stdout_str = NULL;
     gchar *stderr_str = NULL;
+    gchar *config_dir = g_path_get_dirname(CONFIG_FILE);
     gint status = 0;
-    gboolean ok = g_spawn_sync(NULL,
+    gboolean ok = g_spawn_sync(config_dir,
                                (gchar **)argv,
                                NULL,
                                G_SPAWN_SEARCH_PATH,
@@ -247,6 +282,7 @@ static gboolean run_command(char *const argv[], GtkWindow *parent) {
     }
     g_free(stdout_str);
     g_free(stderr_str);
+    g_free(config_dir);
     return ok && status == 0;
 }
 
@@ -415,6 +451,9 @@ void on_create_clicked(GtkButton *button, gpointer user_data) {
     int memory = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(spin_memory));
     int cpu_cores = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(spin_cpu));
     int network = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_network));
+    int io_bps = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(spin_io_bps));
+    int io_iops = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(spin_io_iops));
+    int pids_max = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(spin_pids));
 
     if (!name || !*name) {
         GtkWidget *dialog = gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL, GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, "Please enter a sandbox name");
@@ -454,7 +493,7 @@ void on_create_clicked(GtkButton *button, gpointer user_data) {
     }
 
     // Build argv dynamically - use new -p for CPU cores
-    char *argv_cmd[12] = {0};
+    char *argv_cmd[16] = {0};
     int idx = 0;
     argv_cmd[idx++] = SANDBOX_BIN;
     argv_cmd[idx++] = "-c";
@@ -469,6 +508,22 @@ void on_create_clicked(GtkButton *button, gpointer user_data) {
     if (network) {
         argv_cmd[idx++] = "-n";
     }
+    // Disk limits apply to reads and writes alike; 0 leaves them unlimited
+    char io_buf[96];
+    if (io_bps || io_iops) {
+        int len = 0;
+        io_buf[0] = '\0';
+        if (io_bps) len = snprintf(io_buf, sizeof(io_buf), "rbps=%d,wbps=%d", io_bps, io_bps);
+        if (io_iops) snprintf(io_buf + len, sizeof(io_buf) - len, "%sriops=%d,wiops=%d", len ? "," : "", io_iops, io_iops);
+        argv_cmd[idx++] = "-i";
+        argv_cmd[idx++] = io_buf;
+    }
+    char pids_buf[16];
+    if (pids_max) {
+        snprintf(pids_buf, sizeof(pids_buf), "%d", pids_max);
+        argv_cmd[idx++] = "-P";
+        argv_cmd[idx++] = pids_buf;
+    }
     argv_cmd[idx++] = "-s";
     argv_cmd[idx++] = (char *)name;
     argv_cmd[idx] = NULL;
@@ -477,15 +532,8 @@ void on_create_clicked(GtkButton *button, gpointer user_data) {
         return;
     }
 
-    // Add to list
-    Sandbox *s = malloc(sizeof(Sandbox));
-    strcpy(s->name, name);
-    s->memory = memory;
-    s->cpu_cores = cpu_cores;
-    s->network = network;
-    s->date = time(NULL);
-    sandboxes = g_list_append(sandboxes, s);
-    save_sandboxes();
+    // The CLI has written the sandbox's record
+    reload_sandboxes();
     update_list();
     
     // Refresh sandbox combo boxes in File Explorer and Process Manager
@@ -585,6 +633,9 @@ void on_clear_clicked(GtkButton *button, gpointer user_data) {
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_memory), default_memory);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_cpu), default_cores);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check_network), FALSE);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_io_bps), 0);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_io_iops), 0);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_pids), 0);
 }
 
 void on_delete_clicked(GtkButton *button, gpointer user_data) {
@@ -612,21 +663,13 @@ void on_delete_clicked(GtkButton *button, gpointer user_data) {
         if (!ensure_root(NULL)) return;
 
         // Call delete
-        char *argv_cmd[] = {SANDBOX_BIN, "-d", NULL};
+        char *argv_cmd[] = {SANDBOX_BIN, "-d", "-s", name, NULL};
         if (!run_command(argv_cmd, NULL)) {
             return;
         }
 
-        // Remove from list
-        for (GList *l = sandboxes; l; l = l->next) {
-            Sandbox *s = l->data;
-            if (strcmp(s->name, name) == 0) {
-                sandboxes = g_list_remove(sandboxes, s);
-                free(s);
-                break;
-            }
-        }
-        save_sandboxes();
+        // The CLI has dropped the sandbox's record
+        reload_sandboxes();
         update_list();
         
         // Refresh sandbox combo boxes
@@ -1567,14 +1610,35 @@ static void update_sandbox_details(Sandbox *s) {
     snprintf(buf, sizeof(buf), "<b>%s</b>", s->name);
     gtk_label_set_markup(GTK_LABEL(detail_name_label), buf);
     
-    snprintf(buf, sizeof(buf), "Memory Limit: %d MB", s->memory);
+    if (s->memory_high > 0 && s->memory_high < s->memory) {
+        snprintf(buf, sizeof(buf), "Memory Limit: %d MB (throttled above %d MB)", s->memory, s->memory_high);
+    } else {
+        snprintf(buf, sizeof(buf), "Memory Limit: %d MB", s->memory);
+    }
     gtk_label_set_text(GTK_LABEL(detail_memory_label), buf);
     
     snprintf(buf, sizeof(buf), "CPU Cores: %d", s->cpu_cores);
     gtk_label_set_text(GTK_LABEL(detail_cpu_label), buf);
     
-    gtk_label_set_text(GTK_LABEL(detail_network_label), 
+    gtk_label_set_text(GTK_LABEL(detail_network_label),
+                       s->network == 2 ? "Network: Private (veth + NAT)" :
                        s->network ? "Network: Enabled (Full Access)" : "Network: Disabled (Isolated)");
+
+    // Every io.max field that was set, and io.weight
+    char io_desc[160] = "unlimited", pids_desc[32] = "unlimited";
+    const struct { int value; const char *fmt; } io_fields[] = {
+        {s->io_rbps, "read %d MB/s"}, {s->io_wbps, "write %d MB/s"}, {s->io_riops, "read %d IOPS"},
+        {s->io_wiops, "write %d IOPS"}, {s->io_weight, "weight %d"},
+    };
+    size_t io_len = 0;
+    for (size_t i = 0; i < sizeof(io_fields) / sizeof(io_fields[0]) && io_len < sizeof(io_desc); i++) {
+        if (!io_fields[i].value) continue;
+        if (io_len) io_len += snprintf(io_desc + io_len, sizeof(io_desc) - io_len, ", ");
+        if (io_len < sizeof(io_desc)) io_len += snprintf(io_desc + io_len, sizeof(io_desc) - io_len, io_fields[i].fmt, io_fields[i].value);
+    }
+    if (s->pids_max) snprintf(pids_desc, sizeof(pids_desc), "%d", s->pids_max);
+    snprintf(buf, sizeof(buf), "Disk I/O: %s\nMax Processes: %s", io_desc, pids_desc);
+    gtk_label_set_text(GTK_LABEL(detail_limits_label), buf);
     
     char date_buf[64];
     strftime(date_buf, sizeof(date_buf), "%Y-%m-%d %H:%M:%S", localtime(&s->date));
@@ -1617,13 +1681,7 @@ static void on_refresh_clicked(GtkButton *button, gpointer user_data) {
     (void)user_data;
     
     // Reload sandboxes from file
-    for (GList *l = sandboxes; l; l = l->next) {
-        free(l->data);
-    }
-    g_list_free(sandboxes);
-    sandboxes = NULL;
-    
-    load_sandboxes();
+    reload_sandboxes();
     update_list();
     
     // Refresh combo boxes too
@@ -1833,6 +1891,51 @@ static void on_template_testing_clicked(GtkButton *button, gpointer user_data) {
 
 // ==================== FILE EXPLORER IMPLEMENTATION ====================
 
+// Host path of `path` inside a sandbox's root. Where roots live is up to the CLI's
+// state dir rules, so the root comes from sandbox -R. Asked on every call: a sandbox
+// deleted and created again under the same name may have moved.
+static gboolean sandbox_host_path(const char *sandbox_name, const char *path, char *out, size_t size) {
+    char *argv[] = {SANDBOX_BIN, "-R", "-s", (char *)sandbox_name, NULL};
+    gchar *stdout_str = NULL;
+    gint status = 0;
+    gboolean ok = g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL,
+                               &stdout_str, NULL, &status, NULL) &&
+                  status == 0 && stdout_str && stdout_str[0] == '/';
+    if (ok) {
+        stdout_str[strcspn(stdout_str, "\n")] = '\0';
+        ok = snprintf(out, size, "%s%s", stdout_str, path) < (int)size;
+    }
+    g_free(stdout_str);
+    return ok;
+}
+
+static int remove_tree_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+// rm -rf without a shell; stays on the sandbox's filesystem instead of following bind mounts
+static gboolean remove_tree(const char *path) {
+    return nftw(path, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT) == 0;
+}
+
+// Copy a single file, replacing the destination; symlinks are copied as links
+static gboolean copy_file(const char *src, const char *dest) {
+    GFile *from = g_file_new_for_path(src);
+    GFile *to = g_file_new_for_path(dest);
+    GError *error = NULL;
+    gboolean ok = g_file_copy(from, to, G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS,
+                              NULL, NULL, NULL, &error);
+    if (!ok) {
+        g_printerr("Copy %s -> %s failed: %s\n", src, dest, error->message);
+        g_error_free(error);
+    }
+    g_object_unref(from);
+    g_object_unref(to);
+    return ok;
+}
+
 // Get the currently selected sandbox name from combo box
 static const char* get_selected_sandbox_name(GtkComboBoxText *combo) {
     return gtk_combo_box_text_get_active_text(combo);
@@ -1894,9 +1997,7 @@ static void refresh_file_list(const char *sandbox_name, const char *path) {
     
     // Build sandbox path
     char sandbox_path[PATH_MAX];
-    snprintf(sandbox_path, sizeof(sandbox_path), "/tmp/sandbox_root%s", path);
-    
-    DIR *dir = opendir(sandbox_path);
+    DIR *dir = sandbox_host_path(sandbox_name, path, sandbox_path, sizeof(sandbox_path)) ? opendir(sandbox_path) : NULL;
     if (!dir) {
         GtkTreeIter iter;
         gtk_list_store_append(file_list_store, &iter);
@@ -2035,20 +2136,25 @@ static void on_file_upload_clicked(GtkButton *button, gpointer user_data) {
         "_Cancel", GTK_RESPONSE_CANCEL,
         "_Upload", GTK_RESPONSE_ACCEPT, NULL);
     
+    const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
+    if (!sandbox) {
+        update_status_bar("Please select a sandbox");
+        gtk_widget_destroy(dialog);
+        return;
+    }
+    
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
         char *basename_str = g_path_get_basename(filename);
         
-        char dest_path[PATH_MAX];
-        snprintf(dest_path, sizeof(dest_path), "/tmp/sandbox_root%s/%s", current_file_path, basename_str);
+        char dest_dir[PATH_MAX] = "";
+        char dest_path[PATH_MAX * 2];
+        gboolean found = sandbox_host_path(sandbox, current_file_path, dest_dir, sizeof(dest_dir));
+        snprintf(dest_path, sizeof(dest_path), "%s/%s", dest_dir, basename_str);
         
-        char cmd[PATH_MAX * 2 + 32];
-        snprintf(cmd, sizeof(cmd), "cp '%s' '%s'", filename, dest_path);
-        
-        if (system(cmd) == 0) {
+        if (found && copy_file(filename, dest_path)) {
             update_status_bar("File uploaded successfully");
-            const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
-            if (sandbox) refresh_file_list(sandbox, current_file_path);
+            refresh_file_list(sandbox, current_file_path);
         } else {
             update_status_bar("Upload failed");
         }
@@ -2056,6 +2162,7 @@ static void on_file_upload_clicked(GtkButton *button, gpointer user_data) {
         g_free(basename_str);
         g_free(filename);
     }
+    g_free((gchar*)sandbox);
     gtk_widget_destroy(dialog);
 }
 
@@ -2090,15 +2197,11 @@ static void on_file_download_clicked(GtkButton *button, gpointer user_data) {
     gchar *basename_str = g_path_get_basename(full_path);
     gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), basename_str);
     
-    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+    const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
+    if (sandbox && gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *dest = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
         char src_path[PATH_MAX];
-        snprintf(src_path, sizeof(src_path), "/tmp/sandbox_root%s", full_path);
-        
-        char cmd[PATH_MAX * 2 + 32];
-        snprintf(cmd, sizeof(cmd), "cp '%s' '%s'", src_path, dest);
-        
-        if (system(cmd) == 0) {
+        if (sandbox_host_path(sandbox, full_path, src_path, sizeof(src_path)) && copy_file(src_path, dest)) {
             update_status_bar("File downloaded successfully");
         } else {
             update_status_bar("Download failed");
@@ -2106,6 +2209,7 @@ static void on_file_download_clicked(GtkButton *button, gpointer user_data) {
         g_free(dest);
     }
     
+    g_free((gchar*)sandbox);
     g_free(basename_str);
     g_free(full_path);
     gtk_widget_destroy(dialog);
@@ -2133,22 +2237,19 @@ static void on_file_delete_clicked(GtkButton *button, gpointer user_data) {
     snprintf(msg, sizeof(msg), "Delete %s '%s'?", is_dir ? "folder" : "file", name);
     GtkWidget *dialog = gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL, GTK_MESSAGE_WARNING, GTK_BUTTONS_YES_NO, "%s", msg);
     
-    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES) {
+    const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
+    if (sandbox && gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES) {
         char path_to_delete[PATH_MAX];
-        snprintf(path_to_delete, sizeof(path_to_delete), "/tmp/sandbox_root%s", full_path);
-        
-        char cmd[PATH_MAX + 32];
-        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path_to_delete);
-        
-        if (system(cmd) == 0) {
+        if (sandbox_host_path(sandbox, full_path, path_to_delete, sizeof(path_to_delete)) &&
+            remove_tree(path_to_delete)) {
             update_status_bar("Deleted successfully");
-            const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
-            if (sandbox) refresh_file_list(sandbox, current_file_path);
+            refresh_file_list(sandbox, current_file_path);
         } else {
             update_status_bar("Delete failed");
         }
     }
     
+    g_free((gchar*)sandbox);
     g_free(name);
     g_free(full_path);
     gtk_widget_destroy(dialog);
@@ -2167,24 +2268,25 @@ static void on_file_new_folder_clicked(GtkButton *button, gpointer user_data) {
     gtk_container_add(GTK_CONTAINER(content), entry);
     gtk_widget_show_all(dialog);
     
-    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+    const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
+    if (sandbox && gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         const char *name = gtk_entry_get_text(GTK_ENTRY(entry));
-        if (name && *name) {
-            char new_path[PATH_MAX];
-            snprintf(new_path, sizeof(new_path), "/tmp/sandbox_root%s/%s", current_file_path, name);
-            
-            char cmd[PATH_MAX + 32];
-            snprintf(cmd, sizeof(cmd), "mkdir -p '%s'", new_path);
+        // One folder in the current directory, not a path that could climb out of it
+        if (name && *name && !strchr(name, '/') && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            char parent_path[PATH_MAX] = "";
+            char new_path[PATH_MAX * 2];
+            gboolean found = sandbox_host_path(sandbox, current_file_path, parent_path, sizeof(parent_path));
+            snprintf(new_path, sizeof(new_path), "%s/%s", parent_path, name);
             
-            if (system(cmd) == 0) {
+            if (found && g_mkdir_with_parents(new_path, 0755) == 0) {
                 update_status_bar("Folder created");
-                const char *sandbox = get_selected_sandbox_name(GTK_COMBO_BOX_TEXT(file_explorer_sandbox_combo));
-                if (sandbox) refresh_file_list(sandbox, current_file_path);
+                refresh_file_list(sandbox, current_file_path);
             } else {
                 update_status_bar("Failed to create folder");
             }
         }
     }
+    g_free((gchar*)sandbox);
     gtk_widget_destroy(dialog);
 }
 
@@ -2798,6 +2900,34 @@ int main(int argc, char *argv[]) {
     gtk_box_pack_start(GTK_BOX(create_box), label_cpu_info, FALSE, FALSE, 0);
     update_cpu_info_label();
 
+    // Disk I/O row: bandwidth and IOPS caps, 0 = unlimited
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(create_box), hbox, FALSE, FALSE, 0);
+    label = gtk_label_new("Disk I/O:");
+    gtk_widget_set_size_request(label, 100, -1);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+    spin_io_bps = gtk_spin_button_new_with_range(0, 10000, 10);
+    gtk_widget_set_size_request(spin_io_bps, 80, -1);
+    gtk_box_pack_start(GTK_BOX(hbox), spin_io_bps, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new("MB/s"), FALSE, FALSE, 0);
+    spin_io_iops = gtk_spin_button_new_with_range(0, 1000000, 100);
+    gtk_widget_set_size_request(spin_io_iops, 80, -1);
+    gtk_box_pack_start(GTK_BOX(hbox), spin_io_iops, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new("IOPS (0 = unlimited)"), FALSE, FALSE, 0);
+
+    // Process count row
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(create_box), hbox, FALSE, FALSE, 0);
+    label = gtk_label_new("Max Processes:");
+    gtk_widget_set_size_request(label, 100, -1);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+    spin_pids = gtk_spin_button_new_with_range(0, 100000, 64);
+    gtk_widget_set_size_request(spin_pids, 80, -1);
+    gtk_box_pack_start(GTK_BOX(hbox), spin_pids, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new("(0 = unlimited, stops fork bombs)"), FALSE, FALSE, 0);
+
     // Network checkbox
     check_network = gtk_check_button_new_with_label("🌐 Enable Network Access (requires root, enables apt)");
     gtk_box_pack_start(GTK_BOX(create_box), check_network, FALSE, FALSE, 0);
@@ -2903,6 +3033,10 @@ int main(int argc, char *argv[]) {
     gtk_widget_set_halign(detail_network_label, GTK_ALIGN_START);
     gtk_box_pack_start(GTK_BOX(detail_box), detail_network_label, FALSE, FALSE, 0);
     
+    detail_limits_label = gtk_label_new("");
+    gtk_widget_set_halign(detail_limits_label, GTK_ALIGN_START);
+    gtk_box_pack_start(GTK_BOX(detail_box), detail_limits_label, FALSE, FALSE, 0);
+    
     detail_created_label = gtk_label_new("");
     gtk_widget_set_halign(detail_created_label, GTK_ALIGN_START);
     gtk_box_pack_start(GTK_BOX(detail_box), detail_created_label, FALSE, FALSE, 0);